@@ -7,10 +7,9 @@
  */
 
 // TODO: Improve endianess support
-// TODO: Add LERC support, via libahtse
-// TODO: Allow overlap between tiles
 
 #include <ahtse.h>
+#include <webp/encode.h>
 
 #include <httpd.h>
 #include <http_config.h>
@@ -19,9 +18,15 @@
 #include <http_core.h>
 #include <http_request.h>
 #include <http_log.h>
+#include <util_script.h>
 #include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_thread_mutex.h>
 #include <vector>
 #include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <climits>
 
 extern module AP_MODULE_DECLARE_DATA retile_module;
 
@@ -123,8 +128,21 @@ typedef enum {
 static coord_conv_f* cxf[P_COUNT] = { same_proj, wm2lon, lon2wm, same_proj, same_proj, m2lon, lon2m };
 static coord_conv_f* cyf[P_COUNT] = { same_proj, wm2lat, lat2wm, m2wm, wm2m, m2lat, lat2m };
 
+// Dedicated resampling kernels for exact integer ratio affine scaling
+typedef enum {
+    K_GENERIC = 0, K_COPY, K_HALF, K_DOUBLE
+} KCode;
+
 #define USER_AGENT "AHTSE Retile"
 
+// Maximum number of input tiles for one output tile
+#define MAX_INPUT_TILES 6
+
+// Maximum render width and height, the interpolation line index is 24 bits
+#define MAX_RENDER_SIZE ((1 << 24) - 1)
+
+struct local_source;
+
 struct  repro_conf {
     // The output and input raster figures
     TiledRaster raster, inraster;
@@ -132,6 +150,15 @@ struct  repro_conf {
     // local web path to redirect the source requests
     const char* source, * suffix;
 
+    // Local MRF data and index file names, used instead of the source requests
+    const char* src_data, * src_idx;
+    // The open local files, set in each child, and the next configuration with local files
+    local_source *files;
+    repro_conf *next_local;
+
+    // Extra pixels on each side of the input tiles, duplicated from the neighbors
+    int overlap;
+
     // The reprojection function to be used, also used as an enable flag
     PCode code;
 
@@ -147,6 +174,8 @@ struct  repro_conf {
 
     // Meaning depends on format
     double quality;
+    // Maximum error for LERC output, encoder default if zero
+    double max_z_error;
     // Normalized earth resolution: 1 / (2 * PI * R)
     double eres;
 
@@ -162,9 +191,19 @@ struct  repro_conf {
     // Use NearNb, not bilinear interpolation
     int nearNb;
 
+    // Resampling kernel for each output level, only for affine scaling
+    apr_byte_t *kernels;
+
     // Flag to turn on transparency for formats that do support it
     int has_transparency;
+    // WebP output, not handled by libahtse
+    int webp, webp_lossless;
     int indirect;
+
+    // Maximum output area for bbox render requests, in pixels, zero if disabled
+    apr_int64_t max_render_area;
+    // Maximum input buffer size for bbox render requests, in bytes
+    apr_int64_t max_render_input;
 };
 
 // A structure for the coordinate information used in the current tile conversion
@@ -178,11 +217,19 @@ struct work {
     bbox_t in_bbox;
     // Output tile
     sz5 out_tile;
+    // Output size in pixels, the pagesize for tiles
+    sz5 out_size;
     // Input tile range
     sz5 tl, br;
     // Numerical ETag
     apr_uint64_t seed;
     size_t in_level;
+    // Maximum number of input tiles
+    int max_tiles;
+    // Input tile requests issued, for statistics
+    int in_requests;
+    // Request start time, for statistics
+    apr_time_t start;
 };
 
 // Is the projection GCS
@@ -270,9 +317,21 @@ static int ntiles(const sz5 &tl, const sz5 &br) {
 
 // From a bounding box, calculate the top-left and bottom-right tiles of a specific level of a raster
 // Input level is absolute, the one set in output tiles is relative
-static void bbox_to_tile(const TiledRaster &raster, size_t level, const bbox_t &bb, sz5 &tl_tile, sz5 &br_tile) {
+// Tiles which include overlap pixels on each side cover a larger area, fewer might be needed
+static void bbox_to_tile(const TiledRaster &raster, size_t level, const bbox_t &bbox,
+    sz5 &tl_tile, sz5 &br_tile, int overlap = 0)
+{
     double rx = raster.rsets[level].rx;
     double ry = raster.rsets[level].ry;
+    bbox_t bb(bbox);
+    if (overlap) { // Shrink the bbox by the overlap, at most to the center
+        const double dx = std::min(overlap * rx, (bb.xmax - bb.xmin) / 2);
+        const double dy = std::min(overlap * ry, (bb.ymax - bb.ymin) / 2);
+        bb.xmin += dx;
+        bb.xmax -= dx;
+        bb.ymin += dy;
+        bb.ymax -= dy;
+    }
     double x = (bb.xmin - raster.bbox.xmin) / (rx * raster.pagesize.x);
     double y = (raster.bbox.ymax - bb.ymax) / (ry * raster.pagesize.y);
 
@@ -290,10 +349,162 @@ static void bbox_to_tile(const TiledRaster &raster, size_t level, const bbox_t &
     // Use a tile only if we get more than half pixel in
     if (x - br_tile.x > 0.5 / raster.pagesize.x) br_tile.x++;
     if (y - br_tile.y > 0.5 / raster.pagesize.y) br_tile.y++;
+    // A shrunk bbox still needs one tile
+    if (br_tile.x <= tl_tile.x) br_tile.x = tl_tile.x + 1;
+    if (br_tile.y <= tl_tile.y) br_tile.y = tl_tile.y + 1;
+}
+
+// From the output bbox and size, pick the input level and calculate the input tile range
+// The input tile range uses the absolute input level
+// Returns false if the output is outside of the reprojection valid area
+static bool plan_input(work &info) {
+    const repro_conf *cfg = info.c;
+    bbox_t &oebb = info.out_equiv_bbox;
+
+    // calculate the input projection equivalent bbox
+    oebb.xmin = cxf[cfg->code](cfg->eres, info.out_bbox.xmin);
+    oebb.xmax = cxf[cfg->code](cfg->eres, info.out_bbox.xmax);
+    oebb.ymin = cyf[cfg->code](cfg->eres, info.out_bbox.ymin);
+    oebb.ymax = cyf[cfg->code](cfg->eres, info.out_bbox.ymax);
+    double out_equiv_rx = (oebb.xmax - oebb.xmin) / info.out_size.x;
+    double out_equiv_ry = (oebb.ymax - oebb.ymin) / info.out_size.y;
+
+    // WM and GCS distortion is under 12:1, this eliminates the case outside of WM
+    if (out_equiv_ry < out_equiv_rx / 12)
+        return false;
+
+    // Pick the input level
+    size_t input_l = pick_input_level(info, out_equiv_rx, out_equiv_ry);
+    bbox_to_tile(cfg->inraster, input_l, oebb, info.tl, info.br, cfg->overlap);
+
+    info.tl.z = info.br.z = info.out_tile.z;
+    info.tl.c = info.br.c = cfg->inraster.pagesize.c;
+    info.tl.l = info.br.l = input_l;
+    tile_to_bbox(cfg->inraster, &info.tl, info.in_bbox);
+    // The input buffer starts with the overlap of the top-left tile
+    info.in_bbox.xmin -= cfg->overlap * cfg->inraster.rsets[input_l].rx;
+    info.in_bbox.ymax += cfg->overlap * cfg->inraster.rsets[input_l].ry;
+    return true;
+}
+
+// Fetch an input tile via a subrequest to the source, and generate the tile ETag
+// Returns HTTP_NOT_FOUND for missing or empty tiles
+static apr_status_t fetch_remote(request_rec* r, const repro_conf* cfg, const sz5& tile,
+    const char* user_agent, storage_manager& src, apr_uint64_t& etag)
+{
+    char* sub_uri = tile_url(r->pool, cfg->source, tile, cfg->suffix);
+    subr srequest(r);
+    srequest.agent = user_agent;
+
+    LOGNOTE(r, "Requesting %s", sub_uri);
+    auto status = srequest.fetch(sub_uri, src);
+    if (status != APR_SUCCESS)
+        return status;
+
+    int empty_flag = 0;
+    if (!srequest.ETag.empty()) {
+        etag = base32decode(srequest.ETag.c_str(), &empty_flag);
+        if (empty_flag)
+            return HTTP_NOT_FOUND; // Empty input tiles don't get counted
+    }
+    else { // Input came without an ETag, make one up
+        etag = src.size; // Start with the input tile size
+        // And pick some data out of the input buffer, towards the end
+        if (src.size > 50) {
+            char* tptr = static_cast<char *>(src.buffer) + src.size - 24; // Temporary pointer
+            tptr -= reinterpret_cast<apr_uint64_t>(tptr) % 8; // Make it 8 byte aligned
+            etag ^= *reinterpret_cast<apr_uint64_t*>(tptr);
+            tptr = static_cast<char *>(src.buffer) + src.size - 35; // Temporary pointer
+            tptr -= reinterpret_cast<apr_uint64_t>(tptr) % 8; // Make it 8 byte aligned
+            etag ^= *reinterpret_cast<apr_uint64_t*>(tptr);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+// Local source files, opened once per child and shared by the threads
+struct local_source {
+    apr_file_t* idx, * data;
+#if APR_HAS_THREADS
+    // A tile read is a seek and a read on each file
+    apr_thread_mutex_t* mutex;
+#endif
+};
+
+// MRF index values are big endian 64bit integers
+static apr_uint64_t from_be64(const apr_byte_t* p) {
+    apr_uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Location of a tile index record in an MRF index file, the tile level is absolute
+// The index holds the full resolution level first, then the lower resolution ones
+// Within a level, the z slices are stored one after the other, same as GDAL and mod_mrf
+static apr_off_t idx_offset(const TiledRaster& raster, const sz5& tile) {
+    const apr_off_t slices = (raster.size.z > 1) ? static_cast<apr_off_t>(raster.size.z) : 1;
+    apr_off_t offset = 0;
+    for (int l = raster.n_levels - 1; l > tile.l; l--)
+        offset += slices * raster.rsets[l].w * raster.rsets[l].h;
+    const rset& level = raster.rsets[tile.l];
+    offset += (tile.z * level.h + tile.y) * level.w + tile.x;
+    return offset * 16;
+}
+
+// Read an input tile directly from the local MRF files, the tile level is relative
+// The ETag is built from the index record
+// Returns HTTP_NOT_FOUND for missing or empty tiles
+static apr_status_t read_local(request_rec* r, const repro_conf* cfg, local_source& files,
+    const sz5& tile, storage_manager& src, apr_uint64_t& etag)
+{
+#if APR_HAS_THREADS
+    // Holds the lock until the function returns
+    struct locker {
+        apr_thread_mutex_t* m;
+        locker(apr_thread_mutex_t* mutex) : m(mutex) { apr_thread_mutex_lock(m); }
+        ~locker() { apr_thread_mutex_unlock(m); }
+    } lock(files.mutex);
+#endif
+    sz5 atile(tile);
+    atile.l += cfg->inraster.skip;
+    apr_off_t offset = idx_offset(cfg->inraster, atile);
+    apr_byte_t record[16];
+    apr_size_t nbytes = 0;
+    // Reading past the end of the index means the tile is not present
+    if (APR_SUCCESS != apr_file_seek(files.idx, APR_SET, &offset)
+        || APR_SUCCESS != apr_file_read_full(files.idx, record, sizeof(record), &nbytes))
+        return HTTP_NOT_FOUND;
+
+    apr_off_t data_offset = static_cast<apr_off_t>(from_be64(record));
+    apr_uint64_t size = from_be64(record + 8);
+    if (0 == size)
+        return HTTP_NOT_FOUND; // Empty input tiles don't get counted
+    if (size > static_cast<apr_uint64_t>(src.size)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Input tile too large in %s", cfg->src_data);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (APR_SUCCESS != apr_file_seek(files.data, APR_SET, &data_offset)
+        || APR_SUCCESS != apr_file_read_full(files.data, src.buffer, static_cast<apr_size_t>(size), &nbytes)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Read error from %s", cfg->src_data);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    src.size = static_cast<int>(size);
+    etag = (size << 40) ^ static_cast<apr_uint64_t>(data_offset);
+    return APR_SUCCESS;
+}
+
+// Size in bytes of the input buffer for nx by ny input tiles, including the overlap around the outside tiles
+static apr_int64_t mosaic_size(const TiledRaster &in, apr_int64_t nx, apr_int64_t ny, int overlap)
+{
+    return (nx * in.pagesize.x + 2 * overlap) * (ny * in.pagesize.y + 2 * overlap)
+        * in.pagesize.c * getTypeSize(in.dt);
 }
 
 // Fetches and decodes all tiles between tl and br, writes output in buffer
-// aligned as a single raster
+// aligned as a single raster, which includes the overlap around the outside tiles
+// Overlapping regions of neighboring tiles get written more than once
 // Returns APR_SUCCESS if everything is fine, otherwise an HTTP error code
 static apr_status_t retrieve_source(request_rec* r, work& info, void** buffer)
 {
@@ -301,9 +512,9 @@ static apr_status_t retrieve_source(request_rec* r, work& info, void** buffer)
     repro_conf* cfg = info.c;
     apr_uint64_t& etag_out = info.seed;
 
-    // a reasonable number of input tiles, 64 is a good figure
+    // a reasonable number of input tiles
     int nt = ntiles(tl, br);
-    SERVER_ERR_IF(nt > 6, r, "Too many input tiles required, maximum is 64");
+    SERVER_ERR_IF(nt > info.max_tiles, r, "Too many input tiles required");
 
     // Allocate a buffer for receiving responses, gets reused
     storage_manager src;
@@ -314,12 +525,23 @@ static apr_status_t retrieve_source(request_rec* r, work& info, void** buffer)
 
     // inraster->pagesize.c has to be set correctly
     int input_line_width = int(cfg->inraster.pagesize.x * cfg->inraster.pagesize.c * pixel_size);
-    int pagesize = int(input_line_width * cfg->inraster.pagesize.y);
+    // The output buffer line, in bytes
+    const int ov = cfg->overlap;
+    int line_stride = int(((br.x - tl.x) * cfg->inraster.pagesize.x + 2 * ov)
+        * cfg->inraster.pagesize.c * pixel_size);
 
     // Output buffer
-    apr_size_t bufsize = static_cast<apr_size_t>(pagesize) * nt;
-    if (*buffer == nullptr) // Allocate the buffer if not provided, filled with zeros
+    apr_size_t bufsize = static_cast<apr_size_t>(mosaic_size(cfg->inraster, br.x - tl.x, br.y - tl.y, ov));
+    if (*buffer == nullptr) { // Allocate the buffer if not provided, filled with zeros
         *buffer = apr_pcalloc(r->pool, bufsize);
+        // Floating point data uses the no data value for missing tiles
+        if (ICDT_Float == cfg->inraster.dt && cfg->inraster.has_ndv) {
+            float* fb = reinterpret_cast<float*>(*buffer);
+            const float ndv = static_cast<float>(cfg->inraster.ndv);
+            for (apr_size_t i = 0; i < bufsize / sizeof(float); i++)
+                fb[i] = ndv;
+        }
+    }
 
     // Count of tiles with data
     int count = 0;
@@ -327,57 +549,43 @@ static apr_status_t retrieve_source(request_rec* r, work& info, void** buffer)
     user_agent = (user_agent == nullptr) ? USER_AGENT :
         apr_pstrcat(r->pool, USER_AGENT ", ", user_agent, NULL);
 
+    // Local source files, if configured, opened by child_init
+    SERVER_ERR_IF(cfg->src_data && !cfg->files, r, "Source files not open");
+
     // Retrieve every required tile and decompress them in the right place
     sz5 tile(tl);
     for (tile.y = tl.y; tile.y < br.y; tile.y++) {
         for (tile.x = tl.x; tile.x < br.x; tile.x++) {
-            char* sub_uri = tile_url(r->pool, cfg->source, tile, cfg->suffix);
-            subr srequest(r);
-            srequest.agent = user_agent;
-
-            LOGNOTE(r, "Requesting %s", sub_uri);
+            apr_uint64_t etag = 0;
             src.size = static_cast<int>(cfg->max_input_size);
-            auto status = srequest.fetch(sub_uri, src);
+            info.in_requests++;
+            auto status = cfg->src_data ? read_local(r, cfg, *cfg->files, tile, src, etag)
+                : fetch_remote(r, cfg, tile, user_agent, src, etag);
             if (status != APR_SUCCESS) {
                 if (status == HTTP_NOT_FOUND)
                     continue; // Ignore errors
                 return status; // Othey type of error, passed through
             }
 
-            apr_uint64_t etag;
-            int empty_flag = 0;
-            if (!srequest.ETag.empty()) {
-                etag = base32decode(srequest.ETag.c_str(), &empty_flag);
-                if (empty_flag)
-                    continue; // Ignore empty input tiles, they don't get counted
-            }
-            else { // Input came without an ETag, make one up
-                etag = src.size; // Start with the input tile size
-                // And pick some data out of the input buffer, towards the end
-                if (src.size > 50) {
-                    char* tptr = static_cast<char *>(src.buffer) + src.size - 24; // Temporary pointer
-                    tptr -= reinterpret_cast<apr_uint64_t>(tptr) % 8; // Make it 8 byte aligned
-                    etag ^= *reinterpret_cast<apr_uint64_t*>(tptr);
-                    tptr = static_cast<char *>(src.buffer) + src.size - 35; // Temporary pointer
-                    tptr -= reinterpret_cast<apr_uint64_t>(tptr) % 8; // Make it 8 byte aligned
-                    etag ^= *reinterpret_cast<apr_uint64_t*>(tptr);
-                }
-            }
             // Build up the outgoing ETag
             etag_out = (etag_out << 8) | (0xff & (etag_out >> 56)); // Rotate existing tag
             etag_out ^= etag; // And combine it with the incoming tile etag
 
-            // Set expected values for decoder
+            // Set expected values for decoder, the input tiles include the overlap
             codec_params params(cfg->inraster);
-            params.line_stride = int((br.x - tl.x) * input_line_width);
+            params.size.x += 2 * ov;
+            params.size.y += 2 * ov;
+            params.line_stride = line_stride;
 
             // Location of first byte of this input tile
-            void* b = (char*)(*buffer) + pagesize * (tile.y - tl.y) * (br.x - tl.x)
+            void* b = (char*)(*buffer) + static_cast<apr_size_t>(line_stride) * cfg->inraster.pagesize.y * (tile.y - tl.y)
                 + input_line_width * (tile.x - tl.x);
 
             const char* error_message = stride_decode(params, src, b);
             if (error_message) { // Something went wrong
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "%s decode from :%s", error_message, sub_uri);
+                const char* source_name = cfg->src_data ? cfg->src_data
+                    : tile_url(r->pool, cfg->source, tile, cfg->suffix);
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "%s decode from :%s", error_message, source_name);
                 return HTTP_NOT_FOUND;
             }
             count++; // count the valid tiles
@@ -390,23 +598,32 @@ static apr_status_t retrieve_source(request_rec* r, work& info, void** buffer)
 // These don't have to be bit fields, might be faster if they are not
 // w is weigth of next line *256, can be 0 but not 256.
 // line is the higher line to be interpolated, always positive
+// fw is the full precision weight of the next line, used for floating point data
 struct iline {
     unsigned int w : 8, line : 24;
+    float fw;
 };
 
+// Set an interpolation line from a fractional input line position
+static void set_iline(iline &il, double pos) {
+    // The high line
+    il.line = static_cast<int>(ceil(pos));
+    if (ceil(pos) != floor(pos)) {
+        il.w = static_cast<int>(floor(256.0 * (pos - floor(pos))));
+        il.fw = static_cast<float>(pos - floor(pos));
+    }
+    else { // Perfect match with this line
+        il.w = 255;
+        il.fw = 1.0f;
+    }
+}
+
 // Offset should be Out - In, center of first pixels, real world coordinates
 // If this is negative, we got trouble?
 static void init_ilines(double delta_in, double delta_out, double offset, iline *itable, int lines)
 {
-    for (int i = 0; i < lines; i++) {
-        double pos = (offset + i * delta_out) / delta_in;
-        // The high line
-        itable[i].line = static_cast<int>(ceil(pos));
-        if (ceil(pos) != floor(pos))
-            itable[i].w = static_cast<int>(floor(256.0 * (pos - floor(pos))));
-        else // Perfect match with this line
-            itable[i].w = 255;
-    }
+    for (int i = 0; i < lines; i++)
+        set_iline(itable[i], (offset + i * delta_out) / delta_in);
 }
 
 // Adjust an interpolation table to avoid addressing unavailable lines
@@ -416,10 +633,12 @@ static void adjust_itable(iline *table, int n, unsigned int max_avail) {
     while (n && table[--n].line > max_avail) {
         table[n].line = max_avail;
         table[n].w = 255; // Mostly the last available line
+        table[n].fw = 1.0f;
     }
     for (int i = 0; i < n && table[i].line <= 0; i++) {
         table[i].line = 1;
         table[i].w = 0; // Use line zero value
+        table[i].fw = 0.0f;
     }
 }
 
@@ -477,6 +696,46 @@ template<typename T = apr_byte_t, typename WT = apr_int32_t> static void interpo
     }
 }
 
+// Floating point interpolation, using the full precision weights
+// When the no data value is defined, input values matching it are not used
+// The output is set to the output no data value if none of the inputs are valid
+template<typename T = float> static void interpolateF(
+    const interpolation_buffer &src, interpolation_buffer &dst,
+    const iline *h, const iline *v, bool has_ndv, T ndv, T out_ndv)
+{
+    const size_t colors = static_cast<size_t>(dst.size.c);
+    ap_assert(static_cast<size_t>(src.size.c) == colors);
+    T *data = reinterpret_cast<T *>(dst.buffer);
+    const T *s = reinterpret_cast<const T *>(src.buffer);
+    const size_t slw = static_cast<size_t>(src.size.x) * colors;
+    const bool nan_ndv = (ndv != ndv);
+
+    for (size_t y = 0; y < static_cast<size_t>(dst.size.y); y++) {
+        const T vw = static_cast<T>(v[y].fw);
+        for (size_t x = 0; x < static_cast<size_t>(dst.size.x); x++) {
+            const T hw = static_cast<T>(h[x].fw);
+            size_t idx = slw * v[y].line + h[x].line * colors; // high left index
+            for (size_t c = 0; c < colors; c++, idx++) {
+                // The four input values and their weights
+                const T val[4] = { s[idx - slw - colors], s[idx - slw], s[idx - colors], s[idx] };
+                const T w[4] = { (1 - hw) * (1 - vw), hw * (1 - vw), (1 - hw) * vw, hw * vw };
+                if (!has_ndv) {
+                    *data++ = val[0] * w[0] + val[1] * w[1] + val[2] * w[2] + val[3] * w[3];
+                    continue;
+                }
+                T sum = 0, wsum = 0;
+                for (int i = 0; i < 4; i++) {
+                    if (nan_ndv ? (val[i] != val[i]) : (val[i] == ndv))
+                        continue;
+                    sum += val[i] * w[i];
+                    wsum += w[i];
+                }
+                *data++ = (wsum > 0) ? sum / wsum : out_ndv;
+            }
+        }
+    }
+}
+
 // NearNb sampling, based on ilines
 // Uses the weights to pick between two choices
 template<typename T = apr_byte_t> static void interpolateNN(
@@ -510,6 +769,23 @@ template<typename T = apr_byte_t> static void interpolateNN(
     }
 }
 
+// Replace the input float no data value with the output one, for the kernels which copy input values
+static void remap_ndv(const repro_conf *cfg, interpolation_buffer &dst)
+{
+    if (!cfg->inraster.has_ndv || !cfg->raster.has_ndv)
+        return;
+    const float ndv = static_cast<float>(cfg->inraster.ndv);
+    const float out_ndv = static_cast<float>(cfg->raster.ndv);
+    if (!memcmp(&ndv, &out_ndv, sizeof(float)))
+        return;
+    float *data = reinterpret_cast<float *>(dst.buffer);
+    const size_t count = static_cast<size_t>(dst.size.x) * dst.size.y * dst.size.c;
+    const bool nan_ndv = (ndv != ndv);
+    for (size_t i = 0; i < count; i++)
+        if (nan_ndv ? (data[i] != data[i]) : (data[i] == ndv))
+            data[i] = out_ndv;
+}
+
 // Calls the interpolation for the right data type
 void resample(const repro_conf *cfg, const iline *h,
     const interpolation_buffer &src, interpolation_buffer &dst)
@@ -522,7 +798,16 @@ void resample(const repro_conf *cfg, const iline *h,
     case ICDT_Int16: RESAMP(apr_int16_t); break;
     case ICDT_UInt32: RESAMPwT(apr_uint32_t, apr_uint64_t); break;
     case ICDT_Int32: RESAMPwT(apr_int32_t, apr_int64_t); break;
-    case ICDT_Float: RESAMPwT(float, float); break;
+    case ICDT_Float:
+        if (cfg->nearNb) {
+            interpolateNN<float>(src, dst, h, v);
+            remap_ndv(cfg, dst);
+        }
+        else
+            interpolateF<float>(src, dst, h, v, cfg->inraster.has_ndv != 0,
+                static_cast<float>(cfg->inraster.ndv),
+                static_cast<float>(cfg->raster.has_ndv ? cfg->raster.ndv : cfg->inraster.ndv));
+        break;
     default: // Byte
         RESAMP(apr_byte_t);
     }
@@ -530,19 +815,184 @@ void resample(const repro_conf *cfg, const iline *h,
 #undef RESAMPwT
 }
 
+// Straight copy of a window of the source, 1:1 scaling
+static void copy_window(const interpolation_buffer &src, interpolation_buffer &dst, size_t ox, size_t oy)
+{
+    const size_t slw = static_cast<size_t>(src.size.x * src.pixel_size);
+    const size_t dlw = static_cast<size_t>(dst.size.x * dst.pixel_size);
+    const char *s = reinterpret_cast<const char *>(src.buffer) + oy * slw + ox * src.pixel_size;
+    char *d = reinterpret_cast<char *>(dst.buffer);
+    for (size_t y = 0; y < static_cast<size_t>(dst.size.y); y++, s += slw, d += dlw)
+        memcpy(d, s, dlw);
+}
+
+// Row loops of the kernels below, the restrict pointers let them vectorize without alias checks
+
+// 2x2 box average of one band
+template<typename T, typename WT> static void half_row(const T * __restrict s0, const T * __restrict s1,
+    T * __restrict d, size_t w)
+{
+    for (size_t x = 0; x < w; x++)
+        d[x] = static_cast<T>((static_cast<WT>(s0[2 * x]) + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1]) / 4);
+}
+
+// Vertical sum of two lines
+template<typename T, typename WT> static void sum_rows(const T * __restrict s0, const T * __restrict s1,
+    WT * __restrict v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        v[i] = static_cast<WT>(s0[i]) + s1[i];
+}
+
+// Horizontal average of the vertical sums, multiple bands
+template<typename T, typename WT> static void half_sums(const WT * __restrict v, T * __restrict d,
+    size_t dlw, size_t colors)
+{
+    for (size_t x = 0; x < dlw; x += colors, v += 2 * colors)
+        for (size_t c = 0; c < colors; c++)
+            d[x + c] = static_cast<T>((v[c] + v[colors + c]) / 4);
+}
+
+// Pixel doubling of one line
+template<typename T> static void double_row(const T * __restrict s, T * __restrict d,
+    size_t w, size_t colors)
+{
+    if (1 == colors) {
+        for (size_t x = 0; x < w; x++)
+            d[2 * x] = d[2 * x + 1] = s[x];
+        return;
+    }
+    for (size_t x = 0; x < w; x++, s += colors, d += 2 * colors)
+        for (size_t c = 0; c < colors; c++)
+            d[c] = d[colors + c] = s[c];
+}
+
+// 2x2 box average, 2:1 scaling, same as bilinear interpolation at this ratio
+template<typename T, typename WT = apr_int32_t> static void box_half(
+    const interpolation_buffer &src, interpolation_buffer &dst, size_t ox, size_t oy)
+{
+    const size_t colors = static_cast<size_t>(dst.size.c);
+    const size_t slw = static_cast<size_t>(src.size.x) * colors;
+    const size_t dlw = static_cast<size_t>(dst.size.x) * colors;
+    // Vertical sums of the two input lines, for multiple bands
+    vector<WT> line(1 == colors ? 0 : 2 * dlw);
+    T *d = reinterpret_cast<T *>(dst.buffer);
+    for (size_t y = 0; y < static_cast<size_t>(dst.size.y); y++, d += dlw) {
+        const T *s0 = reinterpret_cast<const T *>(src.buffer) + (oy + 2 * y) * slw + ox * colors;
+        if (1 == colors) {
+            half_row<T, WT>(s0, s0 + slw, d, dlw);
+            continue;
+        }
+        sum_rows<T, WT>(s0, s0 + slw, line.data(), 2 * dlw);
+        half_sums<T, WT>(line.data(), d, dlw, colors);
+    }
+}
+
+// Pixel doubling, 1:2 scaling, same as nearest neighbor at this ratio
+template<typename T> static void double_pixels(
+    const interpolation_buffer &src, interpolation_buffer &dst, size_t ox, size_t oy)
+{
+    const size_t colors = static_cast<size_t>(dst.size.c);
+    const size_t slw = static_cast<size_t>(src.size.x) * colors;
+    const size_t dlw = static_cast<size_t>(dst.size.x) * colors;
+    T *d = reinterpret_cast<T *>(dst.buffer);
+    for (size_t y = 0; y < static_cast<size_t>(dst.size.y); y += 2, d += 2 * dlw) {
+        const T *s = reinterpret_cast<const T *>(src.buffer) + (oy + y / 2) * slw + ox * colors;
+        double_row<T>(s, d, static_cast<size_t>(dst.size.x) / 2, colors);
+        // The next line is identical
+        memcpy(d + dlw, d, dlw * sizeof(T));
+    }
+}
+
+// Use a dedicated kernel, if one was picked for this output level and the input covers the output
+// Returns false if the generic resampling has to be used
+static bool fast_resample(const work &info, int kernel,
+    const interpolation_buffer &src, interpolation_buffer &dst)
+{
+    const repro_conf *cfg = info.c;
+    if (K_GENERIC == kernel)
+        return false;
+
+    // Input pixel offset of the output tile, known to be an integer
+    const rset &in_rset = cfg->inraster.rsets[info.tl.l];
+    const double fx = (info.out_equiv_bbox.xmin - info.in_bbox.xmin) / in_rset.rx;
+    const double fy = (info.in_bbox.ymax - info.out_equiv_bbox.ymax) / in_rset.ry;
+    if (fx < -0.5 || fy < -0.5)
+        return false;
+    const size_t ox = static_cast<size_t>(fx + 0.5), oy = static_cast<size_t>(fy + 0.5);
+
+    // Input size used, for the output size, per kernel
+    size_t wx = static_cast<size_t>(dst.size.x), wy = static_cast<size_t>(dst.size.y);
+    if (K_HALF == kernel) {
+        wx *= 2;
+        wy *= 2;
+    }
+    else if (K_DOUBLE == kernel) {
+        wx /= 2;
+        wy /= 2;
+    }
+    if (ox + wx > static_cast<size_t>(src.size.x) || oy + wy > static_cast<size_t>(src.size.y))
+        return false;
+
+#define KERNEL(T) if (K_HALF == kernel) box_half<T>(src, dst, ox, oy); else double_pixels<T>(src, dst, ox, oy)
+#define KERNELwT(T, WT) if (K_HALF == kernel) box_half<T, WT>(src, dst, ox, oy); else double_pixels<T>(src, dst, ox, oy)
+    if (K_COPY == kernel)
+        copy_window(src, dst, ox, oy);
+    else switch (cfg->raster.dt) {
+    case ICDT_UInt16: KERNEL(apr_uint16_t); break;
+    case ICDT_Int16: KERNEL(apr_int16_t); break;
+    case ICDT_UInt32: KERNELwT(apr_uint32_t, apr_uint64_t); break;
+    case ICDT_Int32: KERNELwT(apr_int32_t, apr_int64_t); break;
+    case ICDT_Float: KERNELwT(float, float); break;
+    default: // Byte
+        KERNEL(apr_byte_t);
+    }
+#undef KERNEL
+#undef KERNELwT
+    if (ICDT_Float == cfg->raster.dt)
+        remap_ndv(cfg, dst);
+    return true;
+}
+
+// Check that all count values in the buffer are equal to val, bitwise
+// Comparing the buffer with itself shifted by one value is vectorized by memcmp
+template<typename T> static bool is_uniform(const void *buffer, size_t count, T val) {
+    const T *p = reinterpret_cast<const T *>(buffer);
+    if (0 == count || memcmp(p, &val, sizeof(T)))
+        return false;
+    return 0 == memcmp(p, p + 1, (count - 1) * sizeof(T));
+}
+
+// Is the raw output page filled with the no data value
+static bool is_ndv_page(const repro_conf *cfg, const storage_manager &raw)
+{
+#define UNIFORM(T) is_uniform<T>(raw.buffer, raw.size / sizeof(T), static_cast<T>(ndv))
+    const double ndv = cfg->raster.ndv;
+    switch (cfg->raster.dt) {
+    case ICDT_UInt16: return UNIFORM(apr_uint16_t);
+    case ICDT_Int16: return UNIFORM(apr_int16_t);
+    case ICDT_UInt32: return UNIFORM(apr_uint32_t);
+    case ICDT_Int32: return UNIFORM(apr_int32_t);
+    case ICDT_Float: return UNIFORM(float);
+    default: // Byte
+        return UNIFORM(apr_byte_t);
+    }
+#undef UNIFORM
+}
+
 // The x dimension is most of the time linear, convenience function
 static void prep_x(work &info, iline *table) {
     bbox_t &bbox = info.out_equiv_bbox;
-    const double out_r = (bbox.xmax - bbox.xmin) / info.c->raster.pagesize.x;
+    const double out_r = (bbox.xmax - bbox.xmin) / info.out_size.x;
     const double in_r = info.c->inraster.rsets[info.tl.l].rx;
     const double offset = bbox.xmin - info.in_bbox.xmin + 0.5 * (out_r - in_r);
-    init_ilines(in_r, out_r, offset, table, static_cast<int>(info.c->raster.pagesize.x));
+    init_ilines(in_r, out_r, offset, table, static_cast<int>(info.out_size.x));
 }
 
 // Initialize ilines for y
 // coord_f is the function converting from output coordinates to input
 static void prep_y(work &info, iline *table, coord_conv_f coord_f) {
-    const int size = static_cast<int>(info.c->raster.pagesize.y);
+    const int size = static_cast<int>(info.out_size.y);
     const double out_r = (info.out_bbox.ymax - info.out_bbox.ymin) / size;
     const double in_r = info.c->inraster.rsets[info.tl.l].ry;
     double offset = info.in_bbox.ymax - 0.5 * in_r;
@@ -550,13 +1000,19 @@ static void prep_y(work &info, iline *table, coord_conv_f coord_f) {
         // Coordinate of output line in input projection
         const double coord = coord_f(info.c->eres, info.out_bbox.ymax - out_r * (i + 0.5));
         // Same in pixels
-        const double pos = (offset - coord) / in_r;
-        table[i].line = static_cast<int>(ceil(pos)); // higher line
-        table[i].w = (ceil(pos) == floor(pos)) ? 255 :
-            static_cast<int>(floor(256.0 * (pos - floor(pos))));
+        set_iline(table[i], (offset - coord) / in_r);
     }
 }
 
+// Record the request statistics in the notes table, where they can be logged
+// with %{retile_code}n %{retile_inputs}n %{retile_usec}n in a LogFormat
+// These are the data feed of the tools/loadtest harness
+static void set_stats(request_rec *r, const work &info) {
+    apr_table_setn(r->notes, "retile_code", apr_psprintf(r->pool, "%d", static_cast<int>(info.c->code)));
+    apr_table_setn(r->notes, "retile_inputs", apr_psprintf(r->pool, "%d", info.in_requests));
+    apr_table_setn(r->notes, "retile_usec", apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_now() - info.start));
+}
+
 #if defined(_DEBUG)
 static void DEBUG_dump_interpolation_buffer(const interpolation_buffer &b, const char* filen) {
     FILE* f = fopen(filen, "wb");
@@ -570,58 +1026,211 @@ static void DEBUG_dump_interpolation_buffer(const interpolation_buffer &b, const
 #define DEBUG_dump_interpolation_buffer(...)
 #endif
 
-static int handler(request_rec *r)
-{
-    if (r->method_number != M_GET)
+// Parse the bbox render request arguments, bbox=xmin,ymin,xmax,ymax&width=W&height=H
+// Returns DECLINED if this is not a render request, HTTP_BAD_REQUEST if the arguments are not valid
+static int render_args(request_rec *r, work &info) {
+    const repro_conf *cfg = info.c;
+    if (!r->args)
         return DECLINED;
-
-    auto* cfg = get_conf<repro_conf>(r, &retile_module);
-    if (!cfg || cfg->code >= P_COUNT || !cfg->source ||
-        (cfg->indirect && r->main == nullptr) ||
-        !cfg->arr_rxp || !requestMatches(r, cfg->arr_rxp))
+    apr_table_t *args = nullptr;
+    ap_args_to_table(r, &args);
+    const char *bbox = apr_table_get(args, "bbox");
+    if (!bbox)
         return DECLINED;
 
-    work info = {0};
-    info.c = cfg;
-    info.seed = cfg->seed;
-    sz5& tile = info.out_tile;
-    bbox_t& oebb = info.out_equiv_bbox;
-    memset(&tile, 0, sizeof(tile));
+    bbox_t &bb = info.out_bbox;
+    if (4 != sscanf(bbox, "%lf,%lf,%lf,%lf", &bb.xmin, &bb.ymin, &bb.xmax, &bb.ymax)
+        || bb.xmin >= bb.xmax || bb.ymin >= bb.ymax)
+        return HTTP_BAD_REQUEST;
 
-    if (APR_SUCCESS != getMLRC(r, tile, true))
+    // Only inside the output raster
+    const bbox_t &rbb = cfg->raster.bbox;
+    if (bb.xmin < rbb.xmin || bb.xmax > rbb.xmax || bb.ymin < rbb.ymin || bb.ymax > rbb.ymax)
         return HTTP_BAD_REQUEST;
 
-    if (tile.l < 0)
-        return sendEmptyTile(r, cfg->raster.missing);
-    tile.l += cfg->raster.skip;
+    const char *width = apr_table_get(args, "width");
+    const char *height = apr_table_get(args, "height");
+    if (!width || !height)
+        return HTTP_BAD_REQUEST;
 
-    // Outside of bounds tile returns a not-found error
-    if (tile.l >= cfg->raster.n_levels ||
-        tile.x >= cfg->raster.rsets[tile.l].w ||
-        tile.y >= cfg->raster.rsets[tile.l].h)
+    sz5 &size = info.out_size;
+    size = cfg->raster.pagesize;
+    size.x = apr_strtoi64(width, nullptr, 10);
+    size.y = apr_strtoi64(height, nullptr, 10);
+    // Check each dimension, the product could overflow
+    if (size.x <= 0 || size.y <= 0 || size.x > MAX_RENDER_SIZE || size.y > MAX_RENDER_SIZE
+        || size.x > cfg->max_render_area || size.y > cfg->max_render_area / size.x)
+        return HTTP_BAD_REQUEST;
+    if (cfg->webp && (size.x > WEBP_MAX_DIMENSION || size.y > WEBP_MAX_DIMENSION))
         return HTTP_BAD_REQUEST;
 
-    tile_to_bbox(cfg->raster, &(info.out_tile), info.out_bbox);
-    // calculate the input projection equivalent bbox
-    oebb.xmin = cxf[cfg->code](cfg->eres, info.out_bbox.xmin);
-    oebb.xmax = cxf[cfg->code](cfg->eres, info.out_bbox.xmax);
-    oebb.ymin = cyf[cfg->code](cfg->eres, info.out_bbox.ymin);
-    oebb.ymax = cyf[cfg->code](cfg->eres, info.out_bbox.ymax);
-    double out_equiv_rx = (oebb.xmax - oebb.xmin) / cfg->raster.pagesize.x;
-    double out_equiv_ry = (oebb.ymax - oebb.ymin) / cfg->raster.pagesize.y;
+    // Allow the same number of input tiles per output page as for a tile request
+    const sz5 &ps = cfg->raster.pagesize;
+    const apr_int64_t max_tiles = MAX_INPUT_TILES
+        * ((size.x + ps.x - 1) / ps.x) * ((size.y + ps.y - 1) / ps.y);
+    info.max_tiles = static_cast<int>(std::min<apr_int64_t>(max_tiles, INT_MAX));
+    return OK;
+}
 
-    // WM and GCS distortion is under 12:1, this eliminates the case outside of WM
-    if (out_equiv_ry < out_equiv_rx / 12)
-        return sendEmptyTile(r, cfg->raster.missing);
+// Adjust the codec parameters for an output which is not a single page
+static void set_size(codec_params &params, const sz5 &size, ICDataType dt) {
+    params.size = size;
+    params.line_stride = int(size.x * size.c * getTypeSize(dt));
+}
 
-    // Pick the input level
-    size_t input_l = pick_input_level(info, out_equiv_rx, out_equiv_ry);
-    bbox_to_tile(cfg->inraster, input_l, oebb, info.tl, info.br);
+// WebP writer, appends to the output buffer
+struct webp_writer {
+    storage_manager *dst;
+    int used;
+};
 
-    info.tl.z = info.br.z = info.out_tile.z;
-    info.tl.c = info.br.c = cfg->inraster.pagesize.c;
-    info.tl.l = info.br.l = input_l;
-    tile_to_bbox(info.c->inraster, &info.tl, info.in_bbox);
+static int webp_write(const uint8_t *data, size_t data_size, const WebPPicture *picture) {
+    webp_writer *w = static_cast<webp_writer *>(picture->custom_ptr);
+    if (data_size > static_cast<size_t>(w->dst->size - w->used))
+        return 0; // Doesn't fit
+    memcpy(w->dst->buffer + w->used, data, data_size);
+    w->used += static_cast<int>(data_size);
+    return 1;
+}
+
+// Encode byte data as WebP, lossy or lossless
+// Gray inputs are expanded to RGB, two bands are gray and alpha
+// With transparency on, pixels with all bands zero are transparent
+static const char *webp_encode(const repro_conf *cfg, const sz5 &size, storage_manager &raw, storage_manager &dst)
+{
+    // Byte data with one to four bands, checked in read_config
+    const int colors = static_cast<int>(size.c);
+
+    WebPConfig config;
+    const float quality = static_cast<float>(std::min(100.0, std::max(0.0, cfg->quality)));
+    // Lossless uses the quality as effort, mapped to the presets 0 to 9
+    if (!(cfg->webp_lossless ? WebPConfigLosslessPreset(&config, static_cast<int>(quality / 11))
+        : WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, quality)))
+        return "WebP configuration error";
+    // Lossy effort follows the quality, from 0 to 6, 4 at the default quality of 75
+    if (!cfg->webp_lossless)
+        config.method = static_cast<int>(quality * 6 / 100);
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture))
+        return "WebP version error";
+    picture.use_argb = cfg->webp_lossless;
+    picture.width = static_cast<int>(size.x);
+    picture.height = static_cast<int>(size.y);
+
+    const apr_byte_t *src = reinterpret_cast<const apr_byte_t *>(raw.buffer);
+    int ok;
+    if (3 == colors && !cfg->has_transparency)
+        ok = WebPPictureImportRGB(&picture, src, 3 * picture.width);
+    else if (4 == colors)
+        ok = WebPPictureImportRGBA(&picture, src, 4 * picture.width);
+    else { // Expand to RGBA
+        const size_t npixels = static_cast<size_t>(size.x * size.y);
+        std::vector<apr_byte_t> rgba(4 * npixels);
+        for (size_t i = 0; i < npixels; i++, src += colors) {
+            apr_byte_t *p = &rgba[4 * i];
+            if (colors < 3)
+                p[0] = p[1] = p[2] = src[0];
+            else
+                memcpy(p, src, 3);
+            p[3] = (2 == colors) ? src[1] : 255;
+            if (cfg->has_transparency && 0 == (p[0] | p[1] | p[2]))
+                p[3] = 0;
+        }
+        ok = WebPPictureImportRGBA(&picture, rgba.data(), 4 * picture.width);
+    }
+    if (!ok) {
+        WebPPictureFree(&picture);
+        return "WebP import error";
+    }
+
+    webp_writer writer = { &dst, 0 };
+    picture.writer = webp_write;
+    picture.custom_ptr = &writer;
+    ok = WebPEncode(&config, &picture);
+    WebPPictureFree(&picture);
+    if (!ok)
+        return "WebP encoding error";
+    dst.size = writer.used;
+    return nullptr;
+}
+
+// Encode the raw output buffer, returns an error message or nullptr on success
+static const char *encode(const repro_conf *cfg, const sz5 &size, storage_manager &raw, storage_manager &dst) {
+    if (cfg->webp)
+        return webp_encode(cfg, size, raw, dst);
+
+    // This is fragile
+    // TODO: Implement output image selection in libahtse
+    switch (cfg->raster.format) {
+    case IMG_ANY:
+    case IMG_JPEG: {
+        jpeg_params params(cfg->raster);
+        set_size(params, size, cfg->raster.dt);
+        params.quality = static_cast<int>(cfg->quality);
+        return jpeg_encode(params, raw, dst);
+    }
+    case IMG_PNG: {
+        png_params params(cfg->raster);
+        set_size(params, size, cfg->raster.dt);
+        if (cfg->quality < 10) // Otherwise use the default of 6
+            params.compression_level = static_cast<int>(cfg->quality);
+        if (cfg->has_transparency)
+            params.has_transparency = true;
+        return png_encode(params, raw, dst);
+    }
+    case IMG_LERC: {
+        lerc_params params(cfg->raster);
+        set_size(params, size, cfg->raster.dt);
+        if (cfg->max_z_error > 0)
+            params.prec = static_cast<float>(cfg->max_z_error);
+        return lerc_encode(params, raw, dst);
+    }
+    default:
+        break;
+    }
+    return "Unsupported output format";
+}
+
+// Builds and sends the output for a request which matches the configuration
+static int make_output(request_rec *r, work &info)
+{
+    const repro_conf *cfg = info.c;
+    sz5& tile = info.out_tile;
+    memset(&tile, 0, sizeof(tile));
+
+    // A bbox render request, if enabled
+    int render_status = cfg->max_render_area ? render_args(r, info) : DECLINED;
+    if (HTTP_BAD_REQUEST == render_status)
+        return HTTP_BAD_REQUEST;
+    const bool render = (OK == render_status);
+
+    if (!render) {
+        if (APR_SUCCESS != getMLRC(r, tile, true))
+            return HTTP_BAD_REQUEST;
+
+        if (tile.l < 0)
+            return sendEmptyTile(r, cfg->raster.missing);
+        tile.l += cfg->raster.skip;
+
+        // Outside of bounds tile returns a not-found error
+        if (tile.l >= cfg->raster.n_levels ||
+            tile.x >= cfg->raster.rsets[tile.l].w ||
+            tile.y >= cfg->raster.rsets[tile.l].h)
+            return HTTP_BAD_REQUEST;
+
+        tile_to_bbox(cfg->raster, &(info.out_tile), info.out_bbox);
+        info.out_size = cfg->raster.pagesize;
+        info.max_tiles = MAX_INPUT_TILES;
+    }
+
+    if (!plan_input(info))
+        return render ? HTTP_BAD_REQUEST : sendEmptyTile(r, cfg->raster.missing);
+    // The render input is limited by size, a narrow render can need many input tiles
+    if (render && mosaic_size(cfg->inraster, info.br.x - info.tl.x, info.br.y - info.tl.y, cfg->overlap)
+        > cfg->max_render_input)
+        return HTTP_BAD_REQUEST;
+    const size_t input_l = info.in_level;
     // Use relative level to request the data
     info.tl.l -= cfg->inraster.skip;
     info.br.l -= cfg->inraster.skip;
@@ -635,7 +1244,9 @@ static int handler(request_rec *r)
             return status;
         }
         LOGNOTE(r, "Receive failed with code %d for %s", status, r->uri);
-        return sendEmptyTile(r, cfg->raster.missing);
+        // A render request always returns an image of the requested size
+        if (!render)
+            return sendEmptyTile(r, cfg->raster.missing);
     }
     // back to absolute level for input tiles
     info.tl.l = info.br.l = input_l;
@@ -651,62 +1262,50 @@ static int handler(request_rec *r)
     // Outgoing raw tile buffer
     int pixel_size = static_cast<int>(cfg->raster.pagesize.c * getTypeSize(cfg->raster.dt));
     storage_manager raw;
-    raw.size = static_cast<int>(cfg->raster.pagesize.x * cfg->raster.pagesize.y * pixel_size);
+    raw.size = static_cast<int>(info.out_size.x * info.out_size.y * pixel_size);
     raw.buffer = static_cast<char *>(apr_palloc(r->pool, raw.size));
 
     // Set up the input and output 2D interpolation buffers
     interpolation_buffer ib = { buffer, cfg->inraster.pagesize, pixel_size };
     // The input buffer contains multiple input pages
-    ib.size.x *= (info.br.x - info.tl.x);
-    ib.size.y *= (info.br.y - info.tl.y);
+    ib.size.x = ib.size.x * (info.br.x - info.tl.x) + 2 * cfg->overlap;
+    ib.size.y = ib.size.y * (info.br.y - info.tl.y) + 2 * cfg->overlap;
     DEBUG_dump_interpolation_buffer(ib, "/data/temp/ib.pgm");
-    interpolation_buffer ob = { raw.buffer, cfg->raster.pagesize, pixel_size };
+    interpolation_buffer ob = { raw.buffer, info.out_size, pixel_size };
 
     iline *table = static_cast<iline *>(apr_palloc(r->pool, static_cast<apr_size_t>(sizeof(iline)*(ob.size.x + ob.size.y))));
     iline *ytable = table + ob.size.x;
 
-    // The x dimension scaling is always linear
-    prep_x(info, table);
-    adjust_itable(table, static_cast<int>(ob.size.x), static_cast<unsigned int>(ib.size.x - 1));
-    prep_y(info, ytable, cyf[cfg->code]);
-    adjust_itable(ytable, static_cast<int>(ob.size.y), static_cast<unsigned int>(ib.size.y - 1));
-    resample(cfg, table, ib, ob);    // Perform the actual resampling
+    // Exact integer ratio scaling has dedicated kernels
+    const int kernel = (render || !cfg->kernels) ? K_GENERIC : cfg->kernels[tile.l];
+    if (!fast_resample(info, kernel, ib, ob)) {
+        // The x dimension scaling is always linear
+        prep_x(info, table);
+        adjust_itable(table, static_cast<int>(ob.size.x), static_cast<unsigned int>(ib.size.x - 1));
+        prep_y(info, ytable, cyf[cfg->code]);
+        adjust_itable(ytable, static_cast<int>(ob.size.y), static_cast<unsigned int>(ib.size.y - 1));
+        resample(cfg, table, ib, ob);    // Perform the actual resampling
+    }
     DEBUG_dump_interpolation_buffer(ob, "/data/temp/ob.pgm");
 
-    // A buffer for the output tile
+    // A tile filled with the no data value is sent as the empty tile, skipping the encoding
+    if (!render && cfg->raster.has_ndv && is_ndv_page(cfg, raw)) {
+        apr_table_set(r->headers_out, "ETag", cfg->eETag);
+        return sendEmptyTile(r, cfg->raster.missing);
+    }
+
+    // A buffer for the output tile, a render output might need more than the configured size
+    // Incompressible data can encode larger than raw, allow for PNG row filter bytes and zlib, chunk or header overhead
     storage_manager dst;
     dst.size = static_cast<int>(cfg->max_output_size);
-    dst.buffer = static_cast<char*>(apr_palloc(r->pool, dst.size));
-    const char *error_message = "Unknown output format requested";
-
-    // This is fragile
-    // TODO: Implement output image selection in libahtse
-    switch (cfg->raster.format) {
-    case IMG_ANY:
-    case IMG_JPEG: {
-        jpeg_params params(cfg->raster);
-        params.quality = static_cast<int>(cfg->quality);
-        error_message = jpeg_encode(params, raw, dst);
-    }
-                     break;
-    case IMG_PNG: {
-        png_params params(cfg->raster);
-        if (cfg->quality < 10) // Otherwise use the default of 6
-            params.compression_level = static_cast<int>(cfg->quality);
-        if (cfg->has_transparency)
-            params.has_transparency = true;
-        error_message = png_encode(params, raw, dst);
-    }
-                break;
-    case IMG_LERC: {
-        lerc_params params(cfg->raster);
-        error_message = lerc_encode(params, raw, dst);
-    }
-                 break;
-    default:
-        error_message = "Unsupported output format";
+    if (render) {
+        const int bound = raw.size + raw.size / 256 + static_cast<int>(info.out_size.y) + 64 * 1024;
+        if (dst.size < bound)
+            dst.size = bound;
     }
+    dst.buffer = static_cast<char*>(apr_palloc(r->pool, dst.size));
 
+    const char *error_message = encode(cfg, info.out_size, raw, dst);
     if (error_message) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "%s encoding :%s", error_message, r->uri);
         // Something went wrong if compression fails
@@ -717,6 +1316,66 @@ static int handler(request_rec *r)
     return sendImage(r, dst, cfg->mime_type);
 }
 
+static int handler(request_rec *r)
+{
+    if (r->method_number != M_GET)
+        return DECLINED;
+
+    auto* cfg = get_conf<repro_conf>(r, &retile_module);
+    if (!cfg || cfg->code >= P_COUNT || (!cfg->source && !cfg->src_data) ||
+        (cfg->indirect && r->main == nullptr) ||
+        !cfg->arr_rxp || !requestMatches(r, cfg->arr_rxp))
+        return DECLINED;
+
+    work info = {0};
+    info.c = cfg;
+    info.seed = cfg->seed;
+    info.start = apr_time_now();
+    int status = make_output(r, info);
+    // Every handled request gets the statistics, including the empty and error responses
+    set_stats(r, info);
+    return status;
+}
+
+// Is the value an integer, within a small fraction
+static bool is_integer(double v) {
+    return fabs(v - floor(v + 0.5)) < 1e-3;
+}
+
+// For affine scaling, pick a dedicated resampling kernel for each output level
+// A kernel is used when the input to output resolution ratio is exactly 1, 2 or 1/2
+// and the output tiles are aligned with the input pixels
+static void init_kernels(apr_pool_t *p, repro_conf *c)
+{
+    const TiledRaster &out = c->raster, &in = c->inraster;
+    c->kernels = static_cast<apr_byte_t *>(apr_pcalloc(p, out.n_levels));
+    work info = {0};
+    info.c = c;
+    for (int l = out.skip; l < out.n_levels; l++) {
+        const double rx = out.rsets[l].rx, ry = out.rsets[l].ry;
+        const size_t in_l = pick_input_level(info, rx, ry);
+        const double irx = in.rsets[in_l].rx, iry = in.rsets[in_l].ry;
+
+        // Output raster origin in input pixels
+        if (!is_integer((out.bbox.xmin - in.bbox.xmin) / irx)
+            || !is_integer((in.bbox.ymax - out.bbox.ymax) / iry))
+            continue;
+
+        const double ratio = rx / irx;
+        if (fabs(ry / iry - ratio) > 1e-6 * ratio)
+            continue; // Not the same on both axes
+
+        if (fabs(ratio - 1) < 1e-6)
+            c->kernels[l] = K_COPY;
+        else if (fabs(ratio - 2) < 1e-6 && !c->nearNb
+            && !(ICDT_Float == in.dt && in.has_ndv)) // Float no data needs the generic kernel
+            c->kernels[l] = K_HALF;
+        else if (fabs(ratio - 0.5) < 1e-6 && c->nearNb
+            && 0 == out.pagesize.x % 2 && 0 == out.pagesize.y % 2)
+            c->kernels[l] = K_DOUBLE;
+    }
+}
+
 static const char *read_config(cmd_parms *cmd, repro_conf *c, const char *src, const char *fname)
 {
     const char *err_message, *line;
@@ -728,11 +1387,33 @@ static const char *read_config(cmd_parms *cmd, repro_conf *c, const char *src, c
     if (err_message)
         return err_message;
 
+    // Source tile overlap, in pixels
+    line = apr_table_get(kvp, "Overlap");
+    c->overlap = (line) ? atoi(line) : 0;
+    if (c->overlap < 0 || 2 * c->overlap >= c->inraster.pagesize.x || 2 * c->overlap >= c->inraster.pagesize.y)
+        return "Invalid Overlap value";
+
     // Then the real configuration file
     kvp = readAHTSEConfig(cmd->temp_pool, fname, &err_message);
     if (NULL == kvp) return err_message;
+
+    // WebP output is handled here, remove it from the format before configRaster
+    line = apr_table_get(kvp, "Format");
+    if (line && (!apr_strnatcasecmp(line, "webp") || !apr_strnatcasecmp(line, "image/webp")
+        || !apr_strnatcasecmp(line, "webp-lossless"))) {
+        c->webp = 1;
+        c->webp_lossless = !apr_strnatcasecmp(line, "webp-lossless");
+        apr_table_unset(kvp, "Format");
+    }
+    line = apr_table_get(kvp, "MimeType");
+    if (line && !apr_strnatcasecmp(line, "image/webp"))
+        c->webp = 1;
     err_message = const_cast<char *>(configRaster(cmd->pool, kvp, c->raster));
     if (err_message) return err_message;
+    if (c->webp && ICDT_Byte != c->raster.dt)
+        return "WebP requires byte data";
+    if (c->webp && (c->raster.pagesize.c < 1 || c->raster.pagesize.c > 4))
+        return "WebP requires one to four bands";
 
     // Check some basic errors
     // In theory, we could alow the sign/unsigned to slip through
@@ -741,7 +1422,7 @@ static const char *read_config(cmd_parms *cmd, repro_conf *c, const char *src, c
 
     // Output mime type, defaults to jpeg
     line = apr_table_get(kvp, "MimeType");
-    c->mime_type = (line) ? apr_pstrdup(cmd->pool, line) : "image/jpeg";
+    c->mime_type = (line) ? apr_pstrdup(cmd->pool, line) : c->webp ? "image/webp" : "image/jpeg";
 
     // Get the planet circumference in meters, for partial coverages
     line = apr_table_get(kvp, "Radius");
@@ -786,10 +1467,29 @@ static const char *read_config(cmd_parms *cmd, repro_conf *c, const char *src, c
     if (line)
         c->quality = strtod(line, nullptr);
 
+    line = apr_table_get(kvp, "MaxZError");
+    if (line)
+        c->max_z_error = strtod(line, nullptr);
+
     line = apr_table_get(kvp, "Transparency");
     if (line)
         c->has_transparency = getBool(line);
 
+    // Maximum pixel count for bbox render requests, disabled by default
+    // The raw render buffer and its encoded size bound have to fit in an int
+    line = apr_table_get(kvp, "MaxRenderArea");
+    if (line) {
+        c->max_render_area = apr_strtoi64(line, nullptr, 0);
+        const apr_int64_t pixel_size = c->raster.pagesize.c * getTypeSize(c->raster.dt);
+        if (c->max_render_area < 0 || c->max_render_area > INT_MAX / 4 / pixel_size)
+            return "MaxRenderArea too large";
+        // Input for a render, twice the input of a square MaxRenderArea render at twice the output resolution,
+        // which leaves room for the input tile alignment and for renders which are not square
+        const apr_int64_t side = static_cast<apr_int64_t>(sqrt(static_cast<double>(c->max_render_area)))
+            + std::max(c->inraster.pagesize.x, c->inraster.pagesize.y) + 2 * c->overlap;
+        c->max_render_input = 8 * side * side * c->inraster.pagesize.c * getTypeSize(c->inraster.dt);
+    }
+
     // Set the reprojection code, waterfall test
     // First true test sets the value
     c->code =
@@ -799,17 +1499,218 @@ static const char *read_config(cmd_parms *cmd, repro_conf *c, const char *src, c
         IS_WM2M(c) ? P_WM2M :
         P_COUNT;
 
-    return c->code < P_COUNT ? nullptr : "Can't find reprojection function";
+    if (c->code >= P_COUNT)
+        return "Can't find reprojection function";
+
+    if (P_AFFINE == c->code)
+        init_kernels(cmd->pool, c);
+    return nullptr;
+}
+
+// Configurations with local source files, for child_init
+static repro_conf *local_sources = nullptr;
+
+// Local MRF source files, the index file name defaults to the data file name with the .idx extension
+static const char *set_local_source(cmd_parms *cmd, repro_conf *c, const char *dfname, const char *ifname)
+{
+    const bool listed = (nullptr != c->src_data);
+    c->src_data = apr_pstrdup(cmd->pool, dfname);
+    if (ifname)
+        c->src_idx = apr_pstrdup(cmd->pool, ifname);
+    else {
+        const char *ext = strrchr(dfname, '.');
+        if (!ext || strchr(ext, '/'))
+            return "Retile_SourceFiles index file name required";
+        c->src_idx = apr_pstrcat(cmd->pool, apr_pstrndup(cmd->pool, dfname, ext - dfname), ".idx", NULL);
+    }
+
+    // Both files have to be readable, they are opened again in each child
+    const char *fnames[] = { c->src_idx, c->src_data };
+    for (const char *fname : fnames) {
+        apr_file_t *f;
+        if (APR_SUCCESS != apr_file_open(&f, fname, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, cmd->temp_pool))
+            return apr_pstrcat(cmd->pool, "Can't open source file ", fname, NULL);
+        apr_file_close(f);
+    }
+
+    if (!listed) {
+        c->next_local = local_sources;
+        local_sources = c;
+    }
+    return nullptr;
+}
+
+// Accumulates row numbers as a list of ranges, for the analysis report
+struct row_ranges {
+    string text;
+    int first = -1, last = -1;
+
+    void add(int row) {
+        if (first >= 0 && row == last + 1) {
+            last = row;
+            return;
+        }
+        close();
+        first = last = row;
+    }
+
+    void close() {
+        if (first < 0)
+            return;
+        char range[64];
+        if (first == last)
+            snprintf(range, sizeof(range), " %d", first);
+        else
+            snprintf(range, sizeof(range), " %d-%d", first, last);
+        text += range;
+        first = last = -1;
+    }
+};
+
+// Maximum and total number of input tile columns, over all the output tiles of a row
+static void column_spans(work info, int &max_nx, apr_int64_t &sum_nx)
+{
+    const rset &rs = info.c->raster.rsets[info.out_tile.l];
+    for (apr_int64_t x = 0; x < rs.w; x++) {
+        info.out_tile.x = x;
+        tile_to_bbox(info.c->raster, &info.out_tile, info.out_bbox);
+        plan_input(info);
+        const int nx = static_cast<int>(info.br.x - info.tl.x);
+        max_nx = std::max(max_nx, nx);
+        sum_nx += nx;
+    }
+}
+
+// Offline configuration analysis, writes a report to a file, only when running httpd -t
+// The x coordinate conversion is linear for all the reprojections, so the input level, the distortion cutoff and
+// the input tile rows depend only on the output row, while the input tile columns depend only on the output column
+// and the input level. The columns are swept once per input level, which makes the report exact
+static const char *analyze_config(cmd_parms *cmd, repro_conf *c, const char *fname)
+{
+    if (!c->raster.n_levels)
+        return "Retile_ConfigurationFiles has to be set before Retile_Analyze";
+
+    // Skipped on a regular start or restart
+    if (AP_SQ_RM_CONFIG_TEST != ap_state_query(AP_SQ_RUN_MODE))
+        return nullptr;
+
+    apr_file_t *f;
+    if (APR_SUCCESS != apr_file_open(&f, fname, APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE,
+        APR_OS_DEFAULT, cmd->temp_pool))
+        return apr_pstrcat(cmd->pool, "Can't open analysis output file ", fname, NULL);
+
+    const TiledRaster &out = c->raster, &in = c->inraster;
+    apr_file_printf(f, "Level\tInLevels\tRows\tTiles\tMaxInputs\tMeanInputs\tRowsOverLimit\tPeakBuffer\tCutoffRows\n");
+
+    for (int l = out.skip; l < out.n_levels; l++) {
+        const rset &rs = out.rsets[l];
+        // Input tile columns, per input level
+        vector<int> max_nx(in.n_levels, 0);
+        vector<apr_int64_t> sum_nx(in.n_levels, 0);
+        size_t in_min = in.n_levels, in_max = 0;
+        int max_nt = 0;
+        apr_int64_t tiles = 0, sum_nt = 0;
+        apr_size_t peak = 0;
+        row_ranges over, cutoff;
+        int over_count = 0, cutoff_count = 0;
+
+        for (apr_int64_t y = 0; y < rs.h; y++) {
+            work info = {0};
+            info.c = c;
+            info.out_size = out.pagesize;
+            info.out_tile.y = y;
+            info.out_tile.l = l;
+            tile_to_bbox(out, &info.out_tile, info.out_bbox);
+            if (!plan_input(info)) {
+                cutoff.add(static_cast<int>(y));
+                cutoff_count++;
+                continue;
+            }
+
+            const size_t il = info.in_level;
+            if (!max_nx[il])
+                column_spans(info, max_nx[il], sum_nx[il]);
+            const int ny = static_cast<int>(info.br.y - info.tl.y);
+            const int nt = max_nx[il] * ny;
+            tiles += rs.w;
+            sum_nt += sum_nx[il] * ny;
+            max_nt = std::max(max_nt, nt);
+            in_min = std::min(in_min, il);
+            in_max = std::max(in_max, il);
+            if (nt > MAX_INPUT_TILES) {
+                over.add(static_cast<int>(y));
+                over_count++;
+            }
+
+            // Same as the retrieve_source buffer, for the widest input
+            const apr_size_t bsize = static_cast<apr_size_t>(mosaic_size(in, max_nx[il], ny, c->overlap));
+            peak = std::max(peak, bsize);
+        }
+        over.close();
+        cutoff.close();
+
+        const char *in_levels = tiles ? apr_psprintf(cmd->temp_pool, "%d-%d",
+            static_cast<int>(in_min) - in.skip, static_cast<int>(in_max) - in.skip) : "-";
+        apr_file_printf(f, "%d\t%s\t%d\t%" APR_INT64_T_FMT "\t%d\t%.2f\t%d\t%" APR_SIZE_T_FMT "\t%d\n",
+            l - out.skip, in_levels, static_cast<int>(rs.h), tiles, max_nt, tiles ? double(sum_nt) / tiles : 0.0,
+            over_count, peak, cutoff_count);
+        if (over_count)
+            apr_file_printf(f, "# Level %d rows over the %d input tiles limit:%s\n",
+                l - out.skip, MAX_INPUT_TILES, over.text.c_str());
+        if (cutoff_count)
+            apr_file_printf(f, "# Level %d rows past the distortion cutoff:%s\n",
+                l - out.skip, cutoff.text.c_str());
+    }
+
+    apr_file_close(f);
+    return nullptr;
+}
+
+// Set if any configuration uses subrequests to the source, which need mod_receive
+static bool uses_subrequests = false;
+
+static const char *set_remote_source(cmd_parms *cmd, repro_conf *c, const char *src, const char *suffix)
+{
+    uses_subrequests = true;
+    return set_source<repro_conf>(cmd, c, src, suffix);
+}
+
+// Runs before the configuration is read, including on restarts
+static int pre_conf(apr_pool_t* p, apr_pool_t* plog, apr_pool_t* ptemp) {
+    uses_subrequests = false;
+    local_sources = nullptr;
+    return OK;
 }
 
 // Runs after the configuration completes
 static int post_conf(apr_pool_t* p, apr_pool_t* plog, apr_pool_t* ptemp, server_rec* s) {
-    if (!ap_get_output_filter_handle("Receive"))
+    if (uses_subrequests && !ap_get_output_filter_handle("Receive"))
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
             "Receive filter (mod_receive) required for proper operation");
     return OK;
 }
 
+// Open the local source files in each child, the file offsets are not shared between processes
+static void child_init(apr_pool_t* p, server_rec* s) {
+    const apr_int32_t flags = APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_XTHREAD;
+    for (repro_conf *c = local_sources; c; c = c->next_local) {
+        local_source *files = static_cast<local_source *>(apr_pcalloc(p, sizeof(local_source)));
+        // Index records are small and often close to each other, the buffer saves most of the reads
+        if (APR_SUCCESS != apr_file_open(&files->idx, c->src_idx, flags | APR_FOPEN_BUFFERED, APR_OS_DEFAULT, p)
+            || APR_SUCCESS != apr_file_open(&files->data, c->src_data, flags, APR_OS_DEFAULT, p)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Can't open source %s", c->src_data);
+            continue;
+        }
+#if APR_HAS_THREADS
+        if (APR_SUCCESS != apr_thread_mutex_create(&files->mutex, APR_THREAD_MUTEX_DEFAULT, p)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Can't create the source lock for %s", c->src_data);
+            continue;
+        }
+#endif
+        c->files = files;
+    }
+}
+
 static const command_rec cmds[] =
 {
     AP_INIT_TAKE2(
@@ -830,10 +1731,26 @@ static const command_rec cmds[] =
 
     AP_INIT_TAKE12(
     "Retile_Source",
-    (cmd_func)set_source<repro_conf>,
+    (cmd_func)set_remote_source,
+    0,
+    ACCESS_CONF,
+    "Required unless Retile_SourceFiles is used, internal redirect path for the source"
+    ),
+
+    AP_INIT_TAKE12(
+    "Retile_SourceFiles",
+    (cmd_func)set_local_source,
+    0,
+    ACCESS_CONF,
+    "Optional, local MRF data and index files, read directly instead of using Retile_Source"
+    ),
+
+    AP_INIT_TAKE1(
+    "Retile_Analyze",
+    (cmd_func)analyze_config,
     0,
     ACCESS_CONF,
-    "Required, internal redirect path for the source"
+    "Optional, write a configuration analysis report to the given file, when running httpd -t"
     ),
 
     AP_INIT_FLAG(
@@ -849,7 +1766,9 @@ static const command_rec cmds[] =
 
 static void register_hooks(apr_pool_t *p) {
     ap_hook_handler(handler, nullptr, nullptr, APR_HOOK_MIDDLE);
+    ap_hook_pre_config(pre_conf, nullptr, nullptr, APR_HOOK_MIDDLE);
     ap_hook_post_config(post_conf, nullptr, nullptr, APR_HOOK_MIDDLE);
+    ap_hook_child_init(child_init, nullptr, nullptr, APR_HOOK_MIDDLE);
 }
 
 module AP_MODULE_DECLARE_DATA retile_module = {
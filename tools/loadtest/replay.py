@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Trace generator and replay driver for the mod_retile load test harness
+
+generate: writes a trace of random tile requests for an output configuration
+run:      replays a trace at a set concurrency, writes per request results
+
+A trace has one request per line, "phase path".  The phase is a label, for
+example the reprojection being tested.  When a line has only the path, the
+phase is the first path component.  The phases are replayed one at a time,
+in the order they first appear, so each one gets its own throughput figure.
+Recorded access logs can be turned into traces by keeping the request paths.
+"""
+
+import argparse
+import csv
+import http.client
+import math
+import random
+import sys
+import threading
+import time
+from collections import OrderedDict
+
+
+def read_config(fname):
+    "AHTSE configuration file, key followed by values"
+    kvp = {}
+    with open(fname) as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith("#"):
+                continue
+            key, _, value = line.partition(" ")
+            kvp[key.lower()] = value.strip()
+    return kvp
+
+
+def levels(kvp):
+    "Tile matrix sizes, from the top level, without the skipped levels"
+    size = [int(v) for v in kvp["size"].split()[:2]]
+    page = [int(v) for v in kvp.get("pagesize", "512 512").split()[:2]]
+    sizes = []
+    while True:
+        sizes.append(((size[0] + page[0] - 1) // page[0], (size[1] + page[1] - 1) // page[1]))
+        if sizes[-1] == (1, 1):
+            break
+        size = [(size[0] + 1) // 2, (size[1] + 1) // 2]
+    sizes.reverse()
+    return sizes[int(kvp.get("skippedlevels", "0")):]
+
+
+def generate(args):
+    rng = random.Random(args.seed)
+    sizes = levels(read_config(args.config))
+    lo, hi = 0, len(sizes) - 1
+    if args.levels:
+        lo, _, h = args.levels.partition("-")
+        lo, hi = int(lo), int(h or lo)
+    prefix = args.prefix.rstrip("/")
+    phase = args.phase or prefix.strip("/").split("/")[0]
+    out = open(args.out, "a") if args.out else sys.stdout
+    for _ in range(args.count):
+        # Deeper levels have more tiles and get more requests
+        weights = [math.sqrt(w * h) for w, h in sizes[lo:hi + 1]]
+        level = lo + rng.choices(range(hi - lo + 1), weights)[0]
+        w, h = sizes[level]
+        out.write("%s %s/%d/%d/%d\n" % (phase, prefix, level, rng.randrange(h), rng.randrange(w)))
+
+
+def read_trace(fname):
+    phases = OrderedDict()
+    with open(fname) as f:
+        for line in f:
+            fields = line.split()
+            if not fields:
+                continue
+            path = fields[-1]
+            phase = fields[0] if len(fields) > 1 else path.strip("/").split("/")[0]
+            phases.setdefault(phase, []).append(path)
+    return phases
+
+
+def replay_phase(args, phase, paths, writer, lock):
+    queue = list(reversed(paths))
+    qlock = threading.Lock()
+
+    def worker():
+        conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+        while True:
+            with qlock:
+                if not queue:
+                    break
+                path = queue.pop()
+            start = time.monotonic()
+            try:
+                conn.request("GET", path)
+                response = conn.getresponse()
+                size = len(response.read())
+                status = response.status
+            except (OSError, http.client.HTTPException):
+                conn.close()
+                conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+                size, status = 0, 0
+            elapsed = time.monotonic() - start
+            with lock:
+                writer.writerow([phase, path, status, "%.3f" % (elapsed * 1000), size, "%.6f" % start])
+        conn.close()
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=worker) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return time.monotonic() - start
+
+
+def run(args):
+    phases = read_trace(args.trace)
+    lock = threading.Lock()
+    with open(args.out, "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(["phase", "path", "status", "ms", "bytes", "start"])
+        for phase, paths in phases.items():
+            paths = paths * args.repeat
+            elapsed = replay_phase(args, phase, paths, writer, lock)
+            sys.stderr.write("replay: %s %d requests in %.2fs, %.1f req/s\n" % (
+                phase, len(paths), elapsed, len(paths) / elapsed if elapsed else 0))
+
+
+def main():
+    p = argparse.ArgumentParser(description="mod_retile trace generator and replay driver")
+    sub = p.add_subparsers(dest="command", required=True)
+
+    g = sub.add_parser("generate", help="write a random tile request trace")
+    g.add_argument("--config", required=True, help="mod_retile output configuration file")
+    g.add_argument("--prefix", required=True, help="URL up to the tile address, e.g. /gcs2wm/tile")
+    g.add_argument("--phase", help="phase label, defaults to the first prefix component")
+    g.add_argument("--count", type=int, default=1000)
+    g.add_argument("--levels", help="level range, relative, e.g. 3-8")
+    g.add_argument("--seed", type=int, default=1)
+    g.add_argument("--out", help="append to this file instead of stdout")
+
+    r = sub.add_parser("run", help="replay a trace")
+    r.add_argument("--trace", required=True)
+    r.add_argument("--host", default="127.0.0.1")
+    r.add_argument("--port", type=int, default=8080)
+    r.add_argument("--concurrency", type=int, default=8)
+    r.add_argument("--repeat", type=int, default=1, help="replay each phase this many times")
+    r.add_argument("--timeout", type=float, default=60)
+    r.add_argument("--out", default="results.csv")
+
+    args = p.parse_args()
+    generate(args) if args.command == "generate" else run(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+Report for the mod_retile load test harness
+
+Combines the replay results with the httpd access log, which has to use the
+retile log format from httpd.conf.in:
+    %{retile_code}n %{retile_inputs}n %{retile_usec}n %>s %D %U
+
+For each phase, prints the client side throughput and latency percentiles,
+and from the module notes the reprojection code, the input tile requests
+per output tile and the module time.  Requests are matched to phases by the
+first path component.
+"""
+
+import argparse
+import csv
+import math
+from collections import OrderedDict, defaultdict
+
+CODES = ["affine", "gcs2wm", "wm2gcs", "wm2m", "m2wm", "gcs2m", "m2gcs"]
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    # Nearest rank
+    values = sorted(values)
+    return values[max(0, math.ceil(p / 100.0 * len(values)) - 1)]
+
+
+def first_component(path):
+    return path.strip("/").split("/")[0]
+
+
+def read_results(fname):
+    phases = OrderedDict()
+    with open(fname, newline="") as f:
+        for row in csv.DictReader(f):
+            phases.setdefault(row["phase"], []).append(row)
+    return phases
+
+
+def read_log(fname):
+    "Module statistics, by first path component"
+    stats = defaultdict(lambda: {"codes": set(), "inputs": [], "usec": []})
+    with open(fname) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 6 or fields[0] == "-":
+                continue  # Not handled by mod_retile
+            s = stats[first_component(fields[5])]
+            s["codes"].add(int(fields[0]))
+            s["inputs"].append(int(fields[1]))
+            s["usec"].append(int(fields[2]))
+    return stats
+
+
+def main():
+    p = argparse.ArgumentParser(description="mod_retile load test report")
+    p.add_argument("--results", default="results.csv", help="replay.py run output")
+    p.add_argument("--log", help="httpd access log, in the retile format")
+    args = p.parse_args()
+
+    phases = read_results(args.results)
+    stats = read_log(args.log) if args.log else {}
+
+    print("%-10s %-8s %7s %6s %6s %9s %8s %8s %8s %10s %10s %10s" % (
+        "phase", "code", "reqs", "2xx", "err", "req/s", "p50 ms", "p99 ms", "max ms",
+        "inputs/t", "max in/t", "mod p99"))
+    for phase, rows in phases.items():
+        ms = [float(r["ms"]) for r in rows]
+        starts = [float(r["start"]) for r in rows]
+        # Phase wall time, from the first request start to the last request end
+        wall = max(s + m / 1000 for s, m in zip(starts, ms)) - min(starts)
+        ok = sum(1 for r in rows if r["status"].startswith("2"))
+        errors = sum(1 for r in rows if r["status"] == "0" or r["status"].startswith("5"))
+        s = stats.get(phase) or stats.get(first_component(rows[0]["path"]))
+        if s and s["inputs"]:
+            code = ",".join(CODES[c] if c < len(CODES) else str(c) for c in sorted(s["codes"]))
+            server = "%10.2f %10d %10.2f" % (
+                sum(s["inputs"]) / len(s["inputs"]), max(s["inputs"]), percentile(s["usec"], 99) / 1000)
+        else:
+            code, server = "-", "%10s %10s %10s" % ("-", "-", "-")
+        print("%-10s %-8s %7d %6d %6d %9.1f %8.2f %8.2f %8.2f %s" % (
+            phase, code, len(rows), ok, errors, len(rows) / wall if wall > 0 else 0,
+            percentile(ms, 50), percentile(ms, 99), max(ms), server))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+#!/bin/sh
+# mod_retile load test harness
+# Runs httpd with mod_retile against the stand-in source, replays a trace and reports
+# The settings are environment variables, see README.md
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=${WORK:-$(pwd)/loadtest_work}
+APXS=${APXS:-apxs}
+HTTPD=${HTTPD:-$($APXS -q sbindir 2>/dev/null)/httpd}
+SYSMODULES=${SYSMODULES:-$($APXS -q libexecdir 2>/dev/null)}
+MODULES=${MODULES:-$HOME/modules}
+AHTSE_LIB=${AHTSE_LIB:-}
+PORT=${PORT:-8080}
+SRC_PORT=${SRC_PORT:-8081}
+
+# Stand-in source
+FORMAT=${FORMAT:-jpeg}
+BANDS=${BANDS:-3}
+LATENCY=${LATENCY:-0}
+JITTER=${JITTER:-0.3}
+MISSING=${MISSING:-0}
+DETAIL=${DETAIL:-8}
+
+# Replay
+CODES=${CODES:-"affine gcs2wm wm2gcs wm2m"}
+TRACE=${TRACE:-}
+COUNT=${COUNT:-2000}
+LEVELS=${LEVELS:-}
+CONCURRENCY=${CONCURRENCY:-16}
+REPEAT=${REPEAT:-1}
+
+case $FORMAT in
+    jpeg) MIME=image/jpeg; DT=Byte ;;
+    png) MIME=image/png; DT=Byte ;;
+    lerc) MIME=raster/lerc; DT=Float; BANDS=1 ;;
+    *) echo "Unknown FORMAT $FORMAT"; exit 1 ;;
+esac
+
+WM_BBOX=-20037508.34278925,-20037508.34278925,20037508.34278925,20037508.34278925
+mkdir -p "$WORK"
+rm -f "$WORK/access_log" "$WORK/error_log"
+
+# Raster configuration file: name projection size_x size_y pagesize bbox
+raster() {
+    cat > "$WORK/$1.cfg" <<EOF
+Size $3 $4 1 $BANDS
+PageSize $5 $5 1 $BANDS
+Projection $2
+BoundingBox $6
+DataType $DT
+EOF
+}
+
+# The two sources, 512x512 tiles
+raster src_gcs GCS 8192 4096 512 -180,-90,180,90
+raster src_wm WM 8192 8192 512 $WM_BBOX
+
+# Output configurations, 256x256 tiles
+raster affine WM 8192 8192 256 $WM_BBOX
+raster gcs2wm WM 8192 8192 256 $WM_BBOX
+raster wm2gcs GCS 8192 4096 256 -180,-90,180,90
+raster wm2m Mercator 8192 8192 256 $WM_BBOX
+for code in $CODES; do
+    cat >> "$WORK/$code.cfg" <<EOF
+MimeType $MIME
+Format $MIME
+InputBufferSize 4194304
+OutputBufferSize 4194304
+EOF
+done
+
+# One location per reprojection code
+LOCATIONS="$WORK/locations.conf"
+: > "$LOCATIONS"
+for code in $CODES; do
+    case $code in
+        gcs2wm) src=src_gcs ;;
+        *) src=src_wm ;;
+    esac
+    cat >> "$LOCATIONS" <<EOF
+<Location "/$code/">
+    Retile_RegExp ^/$code/tile/\\d+/\\d+/\\d+\$
+    Retile_Source /src/$src/tile
+    Retile_ConfigurationFiles "$WORK/$src.cfg" "$WORK/$code.cfg"
+</Location>
+EOF
+done
+
+LOADAHTSE=""
+[ -n "$AHTSE_LIB" ] && LOADAHTSE="LoadFile \"$AHTSE_LIB\""
+sed -e "s|@WORK@|$WORK|g" -e "s|@PORT@|$PORT|g" -e "s|@SRC_PORT@|$SRC_PORT|g" \
+    -e "s|@SYSMODULES@|$SYSMODULES|g" -e "s|@MODULES@|$MODULES|g" \
+    -e "s|@LOADAHTSE@|$LOADAHTSE|" -e "s|@LOCATIONS@|Include \"$LOCATIONS\"|" \
+    "$HERE/httpd.conf.in" > "$WORK/httpd.conf"
+
+# The trace, generated if not provided
+if [ -z "$TRACE" ]; then
+    TRACE="$WORK/trace.txt"
+    : > "$TRACE"
+    for code in $CODES; do
+        python3 "$HERE/replay.py" generate --config "$WORK/$code.cfg" --prefix "/$code/tile" \
+            --count "$COUNT" ${LEVELS:+--levels $LEVELS} --out "$TRACE"
+    done
+fi
+
+python3 "$HERE/standin.py" --port "$SRC_PORT" --format "$FORMAT" --bands "$BANDS" --size 512 \
+    --latency "$LATENCY" --jitter "$JITTER" --missing "$MISSING" --detail "$DETAIL" &
+STANDIN=$!
+trap 'kill $STANDIN 2>/dev/null; "$HTTPD" -f "$WORK/httpd.conf" -k stop 2>/dev/null' EXIT
+
+"$HTTPD" -f "$WORK/httpd.conf" -k start
+# Wait for both servers
+for i in $(seq 50); do
+    python3 -c "import socket,sys; [socket.create_connection(('127.0.0.1', p), 1) for p in ($PORT, $SRC_PORT)]" \
+        2>/dev/null && break
+    sleep 0.2
+done
+
+python3 "$HERE/replay.py" run --trace "$TRACE" --port "$PORT" --concurrency "$CONCURRENCY" \
+    --repeat "$REPEAT" --out "$WORK/results.csv"
+
+# Let httpd flush the log
+"$HTTPD" -f "$WORK/httpd.conf" -k graceful-stop
+sleep 1
+
+echo "Source $FORMAT, latency ${LATENCY}ms, missing $MISSING, concurrency $CONCURRENCY"
+python3 "$HERE/report.py" --results "$WORK/results.csv" --log "$WORK/access_log"
@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+"""
+Stand-in tile source for the mod_retile load test harness
+
+Serves synthetic JPEG, PNG or LERC tiles for any URL ending in .../L/R/C,
+with a controllable response latency and 404 ratio. No dependencies besides
+the python standard library.
+
+A small number of tile variants is generated at startup, each request gets
+one of them, picked by a hash of the tile address. Missing tiles are also
+picked by hash, so the same tile is always either present or missing.
+"""
+
+import argparse
+import hashlib
+import math
+import random
+import re
+import struct
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+MIME = {"jpeg": "image/jpeg", "png": "image/png", "lerc": "raster/lerc"}
+
+#
+# JPEG, baseline, one or three components, no subsampling
+# The quantized DCT coefficients are generated directly, in zigzag order,
+# so no forward DCT is needed.  All quantization table values are 1
+#
+
+DC_BITS = [0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0]
+DC_VALS = list(range(12))
+AC_BITS = [0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d]
+# The standard luminance order for the short codes, then all other symbols
+AC_VALS = [0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41,
+           0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+           0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0]
+AC_VALS += [(r << 4) | s for r in range(16) for s in range(1, 11)
+            if (r << 4) | s not in AC_VALS]
+
+
+def huffman_codes(bits, vals):
+    "Canonical codes, symbol to (code, length)"
+    codes, code, k = {}, 0, 0
+    for length in range(1, 17):
+        for _ in range(bits[length - 1]):
+            codes[vals[k]] = (code, length)
+            code += 1
+            k += 1
+        code <<= 1
+    return codes
+
+
+DC_CODES = huffman_codes(DC_BITS, DC_VALS)
+AC_CODES = huffman_codes(AC_BITS, AC_VALS)
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.n = 0
+
+    def put(self, value, length):
+        self.acc = (self.acc << length) | (value & ((1 << length) - 1))
+        self.n += length
+        while self.n >= 8:
+            self.n -= 8
+            byte = (self.acc >> self.n) & 0xff
+            self.out.append(byte)
+            if byte == 0xff:
+                self.out.append(0)
+        self.acc &= (1 << self.n) - 1
+
+    def flush(self):
+        if self.n:
+            self.put(0x7f, 8 - self.n)  # Pad with ones
+        return bytes(self.out)
+
+
+def category(v):
+    "Magnitude category and the additional bits"
+    if v == 0:
+        return 0, 0
+    s = abs(v).bit_length()
+    return s, v if v > 0 else v + (1 << s) - 1
+
+
+def segment(marker, payload):
+    return struct.pack(">HH", marker, len(payload) + 2) + payload
+
+
+def jpeg_tile(width, height, bands, rng, detail):
+    comps = 1 if bands == 1 else 3
+    bx, by = (width + 7) // 8, (height + 7) // 8
+    bw = BitWriter()
+    pred = [0] * comps
+    phase = rng.random() * 6.28
+    for j in range(by):
+        for i in range(bx):
+            for c in range(comps):
+                # Smooth DC, in the -1024 to 1016 range, chroma near neutral
+                if c == 0:
+                    dc = int(600 * math.sin(phase + i / 9.0) * math.cos(phase + j / 7.0))
+                else:
+                    dc = rng.randint(-40, 40)
+                s, b = category(dc - pred[c])
+                pred[c] = dc
+                code, length = DC_CODES[s]
+                bw.put(code, length)
+                bw.put(b, s)
+                # A few random low frequency AC coefficients
+                coefs = [0] * 63
+                for _ in range(detail if c == 0 else detail // 4):
+                    coefs[min(62, int(rng.expovariate(0.15)))] = rng.randint(-60, 60)
+                run = 0
+                last = max([k for k in range(63) if coefs[k]], default=-1)
+                for k in range(last + 1):
+                    if coefs[k] == 0:
+                        run += 1
+                        continue
+                    while run > 15:
+                        code, length = AC_CODES[0xf0]
+                        bw.put(code, length)
+                        run -= 16
+                    s, b = category(coefs[k])
+                    code, length = AC_CODES[(run << 4) | s]
+                    bw.put(code, length)
+                    bw.put(b, s)
+                    run = 0
+                if last < 62:
+                    code, length = AC_CODES[0x00]  # EOB
+                    bw.put(code, length)
+    data = bw.flush()
+
+    out = bytearray(b"\xff\xd8")
+    out += segment(0xffe0, b"JFIF\0\x01\x01\0\0\x01\0\x01\0\0")
+    out += segment(0xffdb, b"\0" + b"\x01" * 64)
+    sof = struct.pack(">BHHB", 8, height, width, comps)
+    for c in range(comps):
+        sof += struct.pack(">BBB", c + 1, 0x11, 0)
+    out += segment(0xffc0, sof)
+    out += segment(0xffc4, b"\x00" + bytes(DC_BITS) + bytes(DC_VALS))
+    out += segment(0xffc4, b"\x10" + bytes(AC_BITS) + bytes(AC_VALS))
+    sos = struct.pack(">B", comps)
+    for c in range(comps):
+        sos += struct.pack(">BB", c + 1, 0x00)
+    sos += b"\x00\x3f\x00"
+    out += segment(0xffda, sos)
+    out += data
+    out += b"\xff\xd9"
+    return bytes(out)
+
+#
+# PNG, 8 bit gray, gray-alpha, RGB or RGBA
+#
+
+
+def png_chunk(kind, data):
+    return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data))
+
+
+def png_tile(width, height, bands, rng, detail):
+    ctype = {1: 0, 2: 4, 3: 2, 4: 6}[bands]
+    phase = rng.random() * 6.28
+    raw = bytearray()
+    for y in range(height):
+        raw.append(0)  # No filter
+        for x in range(width):
+            v = int(128 + 100 * math.sin(phase + x / 40.0) * math.cos(phase + y / 30.0))
+            v = max(0, min(255, v + rng.randint(-detail, detail)))
+            pixel = [v, (v + 60) % 256, (v + 120) % 256][:min(bands, 3)] if bands >= 3 else [v]
+            if bands in (2, 4):
+                pixel.append(255)
+            raw += bytes(pixel)
+    return (b"\x89PNG\r\n\x1a\n"
+            + png_chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, ctype, 0, 0, 0))
+            + png_chunk(b"IDAT", zlib.compress(bytes(raw), 6))
+            + png_chunk(b"IEND", b""))
+
+#
+# LERC, version 2 blob, all pixels valid, values stored in one sweep
+#
+
+
+def lerc_tile(width, height, bands, rng, detail):
+    "Single band float, the bands argument is ignored"
+    phase = rng.random() * 6.28
+    values = []
+    for y in range(height):
+        for x in range(width):
+            v = 1000 + 800 * math.sin(phase + x / 50.0) * math.cos(phase + y / 45.0)
+            values.append(v + rng.uniform(-detail, detail))
+    data = struct.pack("<%df" % len(values), *values)
+    values = struct.unpack("<%df" % len(values), data)  # zMin and zMax match the stored values
+    zmin, zmax = min(values), max(values)
+    body = struct.pack("<i", 0)  # No mask bytes, all valid
+    if zmin != zmax:
+        body += b"\x01" + data  # Data in one sweep
+    header_size = 6 + 4 + 6 * 4 + 3 * 8
+    blob_size = header_size + len(body)
+    # Version 2 header: rows, columns, valid pixels, micro block size, blob size, data type (6 is float)
+    header = b"Lerc2 " + struct.pack("<i", 2)
+    header += struct.pack("<6i", height, width, width * height, 8, blob_size, 6)
+    header += struct.pack("<3d", 0.0, zmin, zmax)
+    return header + body
+
+#
+# The server
+#
+
+
+class Source:
+    def __init__(self, args):
+        self.args = args
+        rng = random.Random(args.seed)
+        make = {"jpeg": jpeg_tile, "png": png_tile, "lerc": lerc_tile}[args.format]
+        self.tiles = [make(args.size, args.size, args.bands, rng, args.detail)
+                      for _ in range(args.variants)]
+        self.mime = MIME[args.format]
+        self.count = 0
+        self.lock = threading.Lock()
+
+    def pick(self, key):
+        h = int.from_bytes(hashlib.md5(("%d:%s" % (self.args.seed, key)).encode()).digest()[:8], "little")
+        if (h % 10000) < self.args.missing * 10000:
+            return None
+        return self.tiles[(h >> 16) % len(self.tiles)]
+
+    def delay(self):
+        a = self.args
+        if a.latency <= 0:
+            return 0
+        # Lognormal around the median latency, the jitter is the sigma
+        return a.latency / 1000.0 * math.exp(random.gauss(0, a.jitter))
+
+
+TILE_RE = re.compile(r"/(\d+)/(\d+)/(\d+)(?:\D[^/]*)?$")
+
+
+def make_handler(source):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+        # Headers and body are separate writes, avoid the delayed ACK stall
+        disable_nagle_algorithm = True
+
+        def do_GET(self):
+            with source.lock:
+                source.count += 1
+            m = TILE_RE.search(self.path.split("?")[0])
+            time.sleep(source.delay())
+            tile = source.pick(self.path) if m else None
+            if tile is None:
+                self.send_response(404)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            self.send_response(200)
+            self.send_header("Content-Type", source.mime)
+            self.send_header("Content-Length", str(len(tile)))
+            self.end_headers()
+            self.wfile.write(tile)
+
+        def log_message(self, fmt, *args):
+            if source.args.verbose:
+                sys.stderr.write("standin: " + (fmt % args) + "\n")
+
+    return Handler
+
+
+def main():
+    p = argparse.ArgumentParser(description="Stand-in tile source for mod_retile load tests")
+    p.add_argument("--port", type=int, default=8081)
+    p.add_argument("--format", choices=sorted(MIME), default="jpeg")
+    p.add_argument("--size", type=int, default=512, help="tile size in pixels, square")
+    p.add_argument("--bands", type=int, default=3, choices=[1, 2, 3, 4])
+    p.add_argument("--latency", type=float, default=0, help="median response latency, ms")
+    p.add_argument("--jitter", type=float, default=0.3, help="lognormal sigma of the latency")
+    p.add_argument("--missing", type=float, default=0, help="ratio of 404 tiles, 0 to 1")
+    p.add_argument("--detail", type=int, default=8, help="content detail, controls the tile size")
+    p.add_argument("--variants", type=int, default=8, help="number of distinct tiles")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--write", metavar="FILE", help="write one tile to FILE and exit")
+    p.add_argument("--verbose", action="store_true")
+    args = p.parse_args()
+
+    source = Source(args)
+    if args.write:
+        with open(args.write, "wb") as f:
+            f.write(source.tiles[0])
+        return
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), make_handler(source))
+    server.daemon_threads = True
+    sys.stderr.write("standin: serving %s tiles on port %d, average size %d bytes\n" % (
+        args.format, args.port, sum(len(t) for t in source.tiles) // len(source.tiles)))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()